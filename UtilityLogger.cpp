@@ -55,6 +55,9 @@
  verbosity	failureaudit	   *	- from 0 to 5 (NUM_VERBOSITY_LEVELS), or none, information, warning, error, successaudit, FailureAudit
  append_logs_ok	1			   *    - 1 or true, to append to log file, 0 or false to overwrite
  make_config_file_ok	1	   *	- 1 or true to write config file with Logger::WriteConfigFile(optional filename string)
+ trace_file_name	"MyTrace.json"*	- spans are written here by Logger::WriteTraceFile(), default is LoggerTrace.json
+ span_sample_rate	1		   *	- 0 turns spans off, 1 records every span, n records one span in n per thread
+ span_histograms_ok	0		   *	- 1 or true to count span durations for Logger::LogSpanHistograms()
  *******************************
  ------------------------------------------------------------------------------
  
@@ -127,14 +130,63 @@
  mylog.SuccessAudit( std::string message ) 
  mylog.FailureAudit( std::string message ) 
  ------------------------------------------------------------------------------
+
+ *Timing Spans*
+
+ Spans time a block of code and are written out as a Chrome trace-event JSON 
+ file, which opens in chrome://tracing or ui.perfetto.dev.
+
+ {
+	LogSpan s = mylog.Span("db.query");   - begins timing here
+	RunQuery();
+ }                                        - ends when s goes out of scope, or call s.End()
+
+ mylog.WriteTraceFile( optional string <filename> )  - appends buffered spans to trace_file_name (default LoggerTrace.json) and frees them
+ Each call adds to the same trace, delete the file to start a new one. Spans past 16384 per thread 
+ between calls are dropped, so call WriteTraceFile periodically in long-running programs.
+ mylog.set_span_sample_rate( n )         - 0 turns spans off, 1 records every span (default), n records one in n per thread
+ mylog.set_span_histograms_ok(true)      - counts every span's duration in power-of-two microsecond buckets
+ mylog.LogSpanHistograms()               - logs one information line per span name
+ Ex log: information	span db.query <64us:12 <128us:40 <256us:3 >=4194304us:1
+
+ Opening and closing a span takes no lock. Each thread's buffer grows 256 spans at a time and is 
+ freed once its thread has exited and its spans are written out. Histograms add a lookup of the 
+ span name in a per-thread map on every span, and the first span of each name on a thread briefly 
+ takes that thread's histogram lock. A span must end on the thread that opened it.
+
+ trace_file_name, span_sample_rate and span_histograms_ok can also be set in the config file.
+ ------------------------------------------------------------------------------
+
+ *Bulk Logging*
+
+ Groups of records can be logged in one call. The group is filtered in one pass,
+ written to the log file as a single buffer, and never interleaved with output 
+ from any Logger in the process using the same log_file_name. This covers to_log 
+ mode only. In to_system mode each record is its own Event Log entry, and groups 
+ from Loggers sharing an Event Log (e.g. app_log) can interleave.
+
+ LogBatch batch;
+ batch.Error("row 3 invalid");           - same Information/Warning/Error/SuccessAudit/FailureAudit methods as Logger
+ batch.Add("row 9 invalid", error);
+ mylog.LogBulk(batch);
+
+ mylog.LogBulk( vector<log_record> )     - or a vector of log_record(verbosity, message)
+ mylog.LogBulk( log_record* records, size_t record_count )
+ ------------------------------------------------------------------------------
 */
 
 #include "stdafx.h" 
 #include <stdio.h>  
+#include <stdlib.h>
+#include <ctype.h>
 #include <string>
 #include <fstream>  
 #include <iostream>
 #include <istream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <memory>
 
 // Logger is an unmanaged class, gcroot is used
 // for managed EventLog class pointer member of
@@ -160,10 +212,15 @@ const string DEFAULT_CONFIG_FILE_NAME = "LoggerConfig.ini";
 const mode DEFAULT_LOG_MODE = to_log;
 const verbosity DEFAULT_VERBOSITY = information;
 const win_log DEFAULT_WIN_LOG_NAME = app_log;
+const string DEFAULT_TRACE_FILE_NAME = "LoggerTrace.json";
+const int DEFAULT_SPAN_SAMPLE_RATE = 1;
 
-const int NUM_CONFIG_OPTIONS = 5;
+const int NUM_CONFIG_OPTIONS = 8;
 const int NUM_VERBOSITY_LEVELS = 7;
 const int NUM_MODE_NAMES = 2;
+const int NUM_HISTOGRAM_BUCKETS = 24;	// bucket n holds spans under 2^n us, the last bucket holds everything longer
+const unsigned long SPAN_CHUNK_SIZE = 256;	// spans per chunk, a thread's buffer grows a chunk at a time
+const unsigned long MAX_SPAN_CHUNKS = 64;	// per thread, 16384 spans. Spans past this are dropped until WriteTraceFile
 
 const string mode_names [NUM_MODE_NAMES] = { "to_log", "to_system" };
 
@@ -171,7 +228,8 @@ const string verb_names [NUM_VERBOSITY_LEVELS] = { "none", "information", "warni
 								"successaudit", "failureaudit", "all" };
 
 const string config_options [NUM_CONFIG_OPTIONS] = { "log_file_name", "log_mode", 
-	"verbosity", "append_logs_ok", "make_config_file_ok" };
+	"verbosity", "append_logs_ok", "make_config_file_ok", 
+	"trace_file_name", "span_sample_rate", "span_histograms_ok" };
 
 ostream& operator<<(ostream &out, verbosity v) {
 	out << verb_names[v];
@@ -183,6 +241,158 @@ ostream& operator<<(ostream &out, mode m) {
 	return out;
 }
 
+// One (verbosity, message) pair submitted through Logger::LogBulk
+struct log_record {
+	verbosity record_verbosity;
+	string message;
+	log_record(verbosity v, const string& m) : record_verbosity(v), message(m) {}
+};
+
+// Accumulates records for a single Logger::LogBulk call
+// Ex: LogBatch batch; batch.Error("row 3 invalid"); batch.Error("row 9 invalid"); mylog.LogBulk(batch);
+class LogBatch {
+	
+  private:
+	vector<log_record> records;
+
+  public:
+	void Add(const string& message, const verbosity& message_verbosity) {
+		records.push_back(log_record(message_verbosity, message));
+	}
+
+	void Information(const string& message) { this->Add(message, information); }
+	void Warning(const string& message) { this->Add(message, warning); }
+	void Error(const string& message) { this->Add(message, error); }
+	void SuccessAudit(const string& message) { this->Add(message, successaudit); }
+	void FailureAudit(const string& message) { this->Add(message, failureaudit); }
+
+	void Clear() { records.clear(); }
+	size_t size() const { return records.size(); }
+	const vector<log_record>& get_records() const { return records; }
+};
+
+// Process-wide lock objects for log files, one per log_file_name. Logger locks on these 
+// rather than the interned name so no unrelated code locking the same string can contend
+ref class LogFileLockRegistry {
+	
+  private:
+	static Object^ registry_lock = gcnew Object;
+	static System::Collections::Generic::Dictionary<String^, Object^>^ file_locks = 
+		gcnew System::Collections::Generic::Dictionary<String^, Object^>;
+
+  public:
+	// Returns the lock object for log_file_name, creating it on first use
+	static Object^ Get(String^ log_file_name) {
+		Monitor::Enter(registry_lock);
+		try {
+			Object^ file_lock;
+			if (!file_locks->TryGetValue(log_file_name, file_lock)) {
+				file_lock = gcnew Object;
+				file_locks->Add(log_file_name, file_lock);
+			}
+			return file_lock;
+		}
+		finally {
+			Monitor::Exit(registry_lock);
+		}
+	}
+};
+
+// One completed span, kept in its thread's buffer until WriteTraceFile
+struct span_event {
+	string name;
+	__int64 begin_ticks;
+	__int64 end_ticks;
+};
+
+// A fixed block of span_events. The owning thread fills it and links the next 
+// chunk once it is full. volatile reads and writes are acquire/release under MSVC 
+// and the CLR, which orders each event against written and next
+struct span_chunk {
+	span_event events[SPAN_CHUNK_SIZE];
+	volatile unsigned long written;
+	span_chunk* volatile next;
+	span_chunk() : written(0), next(NULL) {}
+};
+
+// Duration counts for one span name on one thread, only the owning thread increments them
+struct span_histogram {
+	volatile unsigned long buckets[NUM_HISTOGRAM_BUCKETS];
+	span_histogram() {
+		for (int bucket = 0; bucket < NUM_HISTOGRAM_BUCKETS; bucket++) { buckets[bucket] = 0; }
+	}
+};
+
+// Each thread records its spans into its own chain of chunks, so opening and closing 
+// a span takes no lock. Only the owning thread touches tail and adds chunks, only 
+// WriteTraceFile (holding span_lock) reads from head and frees chunks it has written out.
+// A span must end on the thread that opened it.
+struct thread_span_buffer {
+	int thread_id;
+	gcroot<Thread^> owner_thread;	// buffer is retired once this has exited and is drained
+	span_chunk* head;
+	unsigned long head_read;		// events of head already written out
+	span_chunk* tail;
+	volatile unsigned long chunks_allocated;	// written by the owning thread only
+	volatile unsigned long chunks_freed;		// written by WriteTraceFile only
+	volatile unsigned long dropped_count;		// written by the owning thread only
+	unsigned long dropped_reported;				// read and written by WriteTraceFile only
+	unsigned int span_count;	// spans opened on this thread, used for sampling
+
+	// The owning thread finds a name's histogram without a lock. Only adding a new
+	// name takes histogram_lock, which LogSpanHistograms holds while reading
+	map<string, span_histogram> histograms;
+	gcroot<Object^> histogram_lock;
+
+	thread_span_buffer() : thread_id(Thread::CurrentThread->ManagedThreadId), head_read(0), 
+		chunks_allocated(1), chunks_freed(0), dropped_count(0), dropped_reported(0), span_count(0) {
+		owner_thread = Thread::CurrentThread;
+		histogram_lock = gcnew Object;
+		head = tail = new span_chunk;
+	}
+
+	~thread_span_buffer() {
+		while (head != NULL) {
+			span_chunk* next = head->next;
+			delete head;
+			head = next;
+		}
+	}
+
+	// true once every recorded span has been written out
+	bool IsDrained() { return head->next == NULL && head->written == head_read; }
+
+  private:
+	thread_span_buffer(const thread_span_buffer&);
+	thread_span_buffer& operator=(const thread_span_buffer&);
+};
+
+class Logger;
+
+// RAII timing span returned by Logger::Span. Records begin on construction
+// and end on destruction (or an explicit End) into the owning Logger.
+class LogSpan {
+	
+  private:
+	Logger* owner;
+	thread_span_buffer* buffer;	// the opening thread's buffer
+	string name;
+	__int64 begin_ticks;
+	bool keep_event;	// false when sampling drops the span and it only feeds the histograms
+
+	// spans are moved, not copied, so each is closed exactly once
+	LogSpan(const LogSpan&);
+	LogSpan& operator=(const LogSpan&);
+
+  public:
+	LogSpan(Logger* span_owner, const string& span_name);
+	LogSpan(LogSpan&& other);
+	~LogSpan() { End(); }
+
+	// closes the span early, destructor will then do nothing
+	void End();
+};
+
 class Logger {
 	
   private: 
@@ -203,6 +413,16 @@ class Logger {
 	string source_name;
 	win_log win_log_name;
 
+	// Span tracing
+	string trace_file_name;
+	int span_sample_rate;	// 0 = off, 1 = every span, n = one span in n per thread
+	bool span_histograms_ok;
+	int process_id;
+	gcroot<Object^> span_lock;	// held to register a thread's buffer, and by WriteTraceFile and LogSpanHistograms
+	gcroot<ThreadLocal<IntPtr>^> thread_span_slot;	// each thread's thread_span_buffer*
+	vector<shared_ptr<thread_span_buffer> > span_buffers;	// buffers of live or undrained threads, owns them
+	map<string, vector<unsigned long> > retired_histograms;	// merged from retired buffers, guarded by span_lock
+
 private: 
 	// Helper Functions
 	bool MakeBoolFromString(const string& bool_string) {
@@ -223,6 +443,95 @@ private:
 		return gcnew String(c_string.c_str());
 	}
 
+	// Escapes quotes, backslashes and control characters for JSON string values
+	string JsonEscape(const string& raw) {
+		string escaped;
+		for (size_t pos = 0; pos < raw.size(); pos++) {
+			char c = raw[pos];
+			if (c == '"' || c == '\\') { escaped += '\\'; escaped += c; }
+			else if (c == '\n') { escaped += "\\n"; }
+			else if (c == '\t') { escaped += "\\t"; }
+			else if (static_cast<unsigned char>(c) < 0x20) { escaped += ' '; }
+			else { escaped += c; }
+		}
+		return escaped;
+	}
+
+	// Lock shared by every Logger in the process writing to the same log_file_name,
+	// held for a whole Log or LogBulk call so groups are never interleaved
+	Object^ LogFileLock() {
+		return LogFileLockRegistry::Get(CStringToSystemString(log_file_name));
+	}
+
+	// Writes already formatted records to log_file_name with a single write.
+	// Appends, or when append_logs_ok is false truncates the file on the first 
+	// write after it is (re)opened and keeps it open for the following writes,
+	// seeking to the end each time so lines other Loggers appended are kept
+	void WriteToLogFile(const string& formatted_records) {
+		if (append_logs_ok) {
+			log_file.clear();
+			log_file.open(log_file_name, ios::app);
+			if (log_file) {
+				log_file.write(formatted_records.data(), formatted_records.size());
+				log_file.close();
+			}
+		}
+		else {
+			if (!log_file.is_open()) {
+				log_file.clear();
+				log_file.open(log_file_name, ios::out | ios::trunc);
+			}
+			if (log_file) {
+				log_file.seekp(0, ios::end);
+				log_file.write(formatted_records.data(), formatted_records.size());
+				log_file.flush();
+			}
+		}
+	}
+
+	// Returns the calling thread's buffer, registering one on the thread's first span
+	thread_span_buffer* GetThreadSpanBuffer() {
+		IntPtr slot = thread_span_slot->Value;
+		if (slot != IntPtr::Zero) {
+			return static_cast<thread_span_buffer*>(slot.ToPointer());
+		}
+		shared_ptr<thread_span_buffer> buffer(new thread_span_buffer());
+		Monitor::Enter(span_lock);
+		try {
+			span_buffers.push_back(buffer);
+		}
+		finally {
+			Monitor::Exit(span_lock);
+		}
+		thread_span_slot->Value = IntPtr(buffer.get());
+		return buffer.get();
+	}
+
+	// Frees the buffers of threads that have exited once all their spans are written out,
+	// keeping their histograms. span_lock must be held
+	void RetireDeadSpanBuffers() {
+		for (size_t buffer_pos = 0; buffer_pos < span_buffers.size(); ) {
+			thread_span_buffer& buffer = *span_buffers[buffer_pos];
+			if (buffer.owner_thread->IsAlive || !buffer.IsDrained()) {
+				buffer_pos++;
+				continue;
+			}
+			for (map<string, span_histogram>::const_iterator hist_it = buffer.histograms.begin(); 
+				 hist_it != buffer.histograms.end(); ++hist_it) {
+				vector<unsigned long>& buckets = retired_histograms[hist_it->first];
+				if (buckets.empty()) { buckets.resize(NUM_HISTOGRAM_BUCKETS, 0); }
+				for (int bucket = 0; bucket < NUM_HISTOGRAM_BUCKETS; bucket++) {
+					buckets[bucket] += hist_it->second.buckets[bucket];
+				}
+			}
+			span_buffers.erase(span_buffers.begin() + buffer_pos);
+		}
+	}
+
+	double TicksToMicroseconds(__int64 ticks) {
+		return static_cast<double>(ticks) * 1000000.0 / static_cast<double>(Stopwatch::Frequency);
+	}
+
 	String^ WinLogEnumToSystemString(win_log user_win_log) {
 		switch (user_win_log) {
 		case 0: 
@@ -260,6 +569,39 @@ private:
 	void SuccessAudit(const string& message) { this->Log(message, successaudit); }
 	void FailureAudit(const string& message) { this->Log(message, failureaudit); }
 
+	// Logs a group of records in one pass, records above verbosity_threshold are skipped.
+	// In to_log mode the group is written to the log file as a single buffer and is never
+	// interleaved with output from any Logger in this process using the same log_file_name
+	// (the name as given, not the resolved path). Other processes are not covered. In 
+	// to_system mode each record is its own Event Log entry and Loggers writing the same
+	// Event Log under different log_file_names can interleave
+	void LogBulk(const log_record* records, size_t record_count);
+	void LogBulk(const vector<log_record>& records) { 
+		if (!records.empty()) { this->LogBulk(&records[0], records.size()); }
+	}
+	void LogBulk(const LogBatch& batch) { this->LogBulk(batch.get_records()); }
+
+	// Starts a timing span that ends when the returned LogSpan goes out of scope
+	// Ex: { LogSpan s = mylog.Span("db.query"); RunQuery(); }
+	LogSpan Span(const string& span_name) { return LogSpan(this, span_name); }
+
+	// Called by LogSpan when it opens. Decides sampling, sets keep_event and returns
+	// the calling thread's buffer, or NULL if the span needs no timing at all
+	thread_span_buffer* BeginSpan(bool& keep_event);
+
+	// Called by LogSpan when it closes, on the thread that opened it. Moves span_name 
+	// into the thread's buffer when keep_event is set. With histograms on it also 
+	// finds the name's histogram in a per-thread map, without a lock after the name's first span
+	void EndSpan(thread_span_buffer* buffer, string& span_name, __int64 begin_ticks, __int64 end_ticks, bool keep_event);
+
+	// Appends buffered spans to a Chrome trace-event file in JSON Array Format (loads in 
+	// chrome://tracing and Perfetto, the closing ] is optional so later calls keep appending)
+	// then frees their buffer slots. Defaults to trace_file_name
+	void WriteTraceFile(string);
+
+	// Logs one information line per span name with its duration histogram
+	void LogSpanHistograms();
+
 	// Getters and Setters
 
 	// *verbosity_threshold*
@@ -277,6 +619,33 @@ private:
 		verbosity_threshold = user_verbosity;
 	}
 	
+	// * span_sample_rate *
+	int get_span_sample_rate() { return span_sample_rate; }
+
+	// 0 turns spans off, 1 records every span, n records one span in n on each thread
+	void set_span_sample_rate(int user_sample_rate) {
+		if (user_sample_rate >= 0) {
+			span_sample_rate = user_sample_rate;
+		}
+	}
+
+	// * span_histograms_ok *
+	bool get_span_histograms_ok() { return span_histograms_ok; }
+
+	// histograms count every closed span, including ones skipped by sampling
+	void set_span_histograms_ok(const bool& user_histograms_ok) {
+		span_histograms_ok = user_histograms_ok;
+	}
+
+	// * trace_file_name *
+	string get_trace_file_name() { return trace_file_name; }
+
+	void set_trace_file_name(const string& user_trace_file_name) {
+		if (user_trace_file_name.size() < FILENAME_MAX + 1) {
+			trace_file_name = user_trace_file_name;
+		}
+	}
+
 	// * config_file_name *
 	string get_config_file_name() { return config_file_name; } 
 
@@ -360,6 +729,23 @@ private:
 							config_count++;
 						}
 						break;
+					case 5:
+						this->set_trace_file_name(config_parameter);
+						config_count++;
+						break;
+					case 6:
+						index = atoi(config_parameter.c_str());
+						if (index > 0 || config_parameter == "0") {
+							this->set_span_sample_rate(index);
+							config_count++;
+						}
+						break;
+					case 7:
+						if (IsBool(config_parameter)) {
+							this->set_span_histograms_ok(MakeBoolFromString(config_parameter));
+							config_count++;
+						}
+						break;
 					
 					case -1: 
 					default:
@@ -498,59 +884,297 @@ void Logger::Initialize() {
 	source_name = DEFAULT_SOURCE_NAME;
 	win_log_name = DEFAULT_WIN_LOG_NAME;
 	system_log = nullptr;
+	trace_file_name = DEFAULT_TRACE_FILE_NAME;
+	span_sample_rate = DEFAULT_SPAN_SAMPLE_RATE;
+	span_histograms_ok = false;
+	process_id = Process::GetCurrentProcess()->Id;
+	span_lock = gcnew Object;
+	thread_span_slot = gcnew ThreadLocal<IntPtr>();
+	span_buffers.clear();
+	retired_histograms.clear();
+}
+
+LogSpan::LogSpan(Logger* span_owner, const string& span_name) : owner(span_owner), buffer(NULL), begin_ticks(0), keep_event(false) {
+	// spans dropped by sampling with histograms off skip the name copy and the timestamp
+	if (owner != NULL) { buffer = owner->BeginSpan(keep_event); }
+	if (buffer != NULL) {
+		name = span_name;
+		begin_ticks = Stopwatch::GetTimestamp();
+	}
+	else {
+		owner = NULL;
+	}
+}
+
+LogSpan::LogSpan(LogSpan&& other) : owner(other.owner), buffer(other.buffer), begin_ticks(other.begin_ticks), keep_event(other.keep_event) {
+	name.swap(other.name);
+	other.owner = NULL;
+}
+
+void LogSpan::End() {
+	if (owner != NULL) {
+		__int64 end_ticks = Stopwatch::GetTimestamp();
+		owner->EndSpan(buffer, name, begin_ticks, end_ticks, keep_event);
+		owner = NULL;
+	}
+}
+
+thread_span_buffer* Logger::BeginSpan(bool& keep_event) {
+	int sample_rate = span_sample_rate;
+	if (sample_rate <= 0) { return NULL; }
+	thread_span_buffer* buffer = GetThreadSpanBuffer();
+	keep_event = (buffer->span_count++ % sample_rate == 0);
+	return (keep_event || span_histograms_ok) ? buffer : NULL;
+}
+
+void Logger::EndSpan(thread_span_buffer* buffer, string& span_name, __int64 begin_ticks, __int64 end_ticks, bool keep_event) {
+
+	if (span_histograms_ok) {
+		double duration = TicksToMicroseconds(end_ticks - begin_ticks);
+		int bucket = 0;
+		while (bucket < NUM_HISTOGRAM_BUCKETS - 1 && duration >= static_cast<double>(1 << bucket)) {
+			bucket++;
+		}
+		// only this thread adds to its map, so finding needs no lock
+		map<string, span_histogram>::iterator hist_it = buffer->histograms.find(span_name);
+		if (hist_it == buffer->histograms.end()) {
+			Monitor::Enter(buffer->histogram_lock);
+			try {
+				hist_it = buffer->histograms.insert(make_pair(span_name, span_histogram())).first;
+			}
+			finally {
+				Monitor::Exit(buffer->histogram_lock);
+			}
+		}
+		hist_it->second.buckets[bucket] = hist_it->second.buckets[bucket] + 1;
+	}
+
+	if (keep_event) {
+		span_chunk* chunk = buffer->tail;
+		unsigned long written = chunk->written;
+		if (written == SPAN_CHUNK_SIZE) {
+			if (buffer->chunks_allocated - buffer->chunks_freed >= MAX_SPAN_CHUNKS) {
+				buffer->dropped_count = buffer->dropped_count + 1;
+				return;
+			}
+			span_chunk* next_chunk = new span_chunk;
+			buffer->chunks_allocated = buffer->chunks_allocated + 1;
+			chunk->next = next_chunk;	// publishes the full chunk, this thread never touches it again
+			buffer->tail = next_chunk;
+			chunk = next_chunk;
+			written = 0;
+		}
+		span_event& slot = chunk->events[written];
+		slot.name.swap(span_name);
+		slot.begin_ticks = begin_ticks;
+		slot.end_ticks = end_ticks;
+		chunk->written = written + 1;	// publishes the event to WriteTraceFile
+	}
+}
+
+void Logger::WriteTraceFile(string user_trace_file = "") {
+
+	if (user_trace_file == "") { user_trace_file = trace_file_name; }
+
+	unsigned long dropped_total = 0;
+	Monitor::Enter(span_lock);
+	try {
+		// A missing or empty file starts the JSON array. Events only need a separator
+		// when one is already in the file, i.e. the last non-whitespace byte is not [
+		char last_byte = 0;
+		ifstream trace_file_in(user_trace_file, ios::in | ios::binary);
+		if (trace_file_in) {
+			trace_file_in.seekg(0, ios::end);
+			for (streamoff pos = trace_file_in.tellg(); pos > 0 && last_byte == 0; ) {
+				pos--;
+				trace_file_in.seekg(pos);
+				char c = static_cast<char>(trace_file_in.get());
+				if (!isspace(static_cast<unsigned char>(c))) { last_byte = c; }
+			}
+		}
+		trace_file_in.close();
+
+		// spans stay buffered if the file cannot be opened
+		ofstream trace_file_out;
+		trace_file_out.open(user_trace_file, ios::app);
+		if (!trace_file_out) {
+			cout << "Unable to open " << user_trace_file << " for writing." << endl;
+			return;
+		}
+
+		// Complete ("X") events, timestamps and durations in microseconds
+		if (last_byte == 0) { trace_file_out << "["; }
+		bool need_separator = (last_byte != 0 && last_byte != '[');
+		trace_file_out.setf(ios::fixed);
+		trace_file_out.precision(3);
+		for (size_t buffer_pos = 0; buffer_pos < span_buffers.size(); buffer_pos++) {
+			thread_span_buffer& buffer = *span_buffers[buffer_pos];
+			for (;;) {
+				span_chunk* chunk = buffer.head;
+				unsigned long written = chunk->written;
+				for (unsigned long pos = buffer.head_read; pos < written; pos++) {
+					const span_event& event_out = chunk->events[pos];
+					if (need_separator) { trace_file_out << ","; }
+					need_separator = true;
+					trace_file_out << endl << "{\"name\":\"" << JsonEscape(event_out.name) << "\",\"ph\":\"X\""
+						<< ",\"ts\":" << TicksToMicroseconds(event_out.begin_ticks)
+						<< ",\"dur\":" << TicksToMicroseconds(event_out.end_ticks - event_out.begin_ticks)
+						<< ",\"pid\":" << process_id << ",\"tid\":" << buffer.thread_id << "}";
+				}
+				buffer.head_read = written;
+
+				// a full chunk with a successor is finished with by its thread and can go
+				if (written == SPAN_CHUNK_SIZE && chunk->next != NULL) {
+					buffer.head = chunk->next;
+					buffer.head_read = 0;
+					delete chunk;
+					buffer.chunks_freed = buffer.chunks_freed + 1;
+				}
+				else {
+					break;
+				}
+			}
+
+			unsigned long dropped = buffer.dropped_count;
+			dropped_total += dropped - buffer.dropped_reported;
+			buffer.dropped_reported = dropped;
+		}
+		trace_file_out << endl;
+		trace_file_out.close();
+
+		RetireDeadSpanBuffers();
+	}
+	finally {
+		Monitor::Exit(span_lock);
+	}
+
+	if (dropped_total > 0) {
+		cout << dropped_total << " spans dropped since the last WriteTraceFile, call it more often to keep them." << endl;
+	}
+}
+
+void Logger::LogSpanHistograms() {
+	map<string, vector<unsigned long> > histograms_out;
+	Monitor::Enter(span_lock);
+	try {
+		RetireDeadSpanBuffers();
+		histograms_out = retired_histograms;
+		for (size_t buffer_pos = 0; buffer_pos < span_buffers.size(); buffer_pos++) {
+			thread_span_buffer& buffer = *span_buffers[buffer_pos];
+			Monitor::Enter(buffer.histogram_lock);
+			try {
+				for (map<string, span_histogram>::const_iterator hist_it = buffer.histograms.begin(); 
+					 hist_it != buffer.histograms.end(); ++hist_it) {
+					vector<unsigned long>& buckets = histograms_out[hist_it->first];
+					if (buckets.empty()) { buckets.resize(NUM_HISTOGRAM_BUCKETS, 0); }
+					for (int bucket = 0; bucket < NUM_HISTOGRAM_BUCKETS; bucket++) {
+						buckets[bucket] += hist_it->second.buckets[bucket];
+					}
+				}
+			}
+			finally {
+				Monitor::Exit(buffer.histogram_lock);
+			}
+		}
+	}
+	finally {
+		Monitor::Exit(span_lock);
+	}
+
+	// Ex log: information	span db.query <64us:12 <128us:40 <256us:3 >=4194304us:1
+	for (map<string, vector<unsigned long> >::const_iterator hist_it = histograms_out.begin(); 
+		 hist_it != histograms_out.end(); ++hist_it) {
+		ostringstream line;
+		line << "span " << hist_it->first;
+		for (int bucket = 0; bucket < NUM_HISTOGRAM_BUCKETS; bucket++) {
+			if (hist_it->second[bucket] == 0) { continue; }
+			if (bucket == NUM_HISTOGRAM_BUCKETS - 1) {
+				line << " >=" << (1 << (NUM_HISTOGRAM_BUCKETS - 2)) << "us:" << hist_it->second[bucket];
+			}
+			else {
+				line << " <" << (1 << bucket) << "us:" << hist_it->second[bucket];
+			}
+		}
+		this->Log(line.str(), information);
+	}
 }
 
 // Logs a message to the specified destination. Defaults LoggerDefault.log. 
 // Change DEFAULT_LOG_FILE_NAME or use mylog.set_log_file_name("InsertNameHere")
 
 void Logger::Log(const string& message, const verbosity& message_verbosity = all) {
-	// logging to file
-	if (message_verbosity <= verbosity_threshold && message_verbosity != 0) { 
-		if (log_mode == to_log || log_mode == 0) {
-			if (append_logs_ok) {
-				log_file.open(log_file_name, ios::app);
-				if (log_file) {
-					log_file << message_verbosity << "\t" << message << endl;
-					//cout << "logging a " << message_verbosity << " message now under or matching " << verbosity_threshold << endl;
-					log_file.close();
+	Object^ file_lock = LogFileLock();
+	Monitor::Enter(file_lock);
+	try {
+		// logging to file
+		if (message_verbosity <= verbosity_threshold && message_verbosity != 0) { 
+			if (log_mode == to_log || log_mode == 0) {
+				ostringstream record;
+				record << message_verbosity << "\t" << message << "\n";
+				WriteToLogFile(record.str());
+			}
+			// log to Windows Application Log
+			else if (log_mode == to_system || log_mode == 1) {
+				String^ s_message = gcnew String(message.c_str());
+				String^ s_source_name = gcnew String(source_name.c_str());
+				switch (message_verbosity) {
+				case 0: 
+					cout << "message_verbosity set to none, unable to log" << endl;
+					return;
+					break;
+				case 1: 
+					system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::Information);
+					break;
+				case 2: 
+					system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::Warning);
+					break;
+				case 3: 
+					system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::Error);
+					break;
+				case 4: 
+					system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::SuccessAudit);
+					break;
+				case 5:
+					system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::FailureAudit);
+				default: 
+					cout << "Invalid verbosity_threshold " << endl;
+					break;
 				}
 			}
-			else if (log_file) {
-				log_file << message_verbosity << "\t " << message << endl;
-				cout << "logging a " << message_verbosity << " message now under or matching " << 
-				verbosity_threshold << "without appending" << endl;
-				log_file.close();
+		}
+	}
+	finally {
+		Monitor::Exit(file_lock);
+	}
+}
+
+void Logger::LogBulk(const log_record* records, size_t record_count) {
+	Object^ file_lock = LogFileLock();
+	Monitor::Enter(file_lock);
+	try {
+		if (log_mode == to_log || log_mode == 0) {
+			// filter and format the whole group into one buffer
+			ostringstream group;
+			for (size_t pos = 0; pos < record_count; pos++) {
+				const verbosity& record_verbosity = records[pos].record_verbosity;
+				if (record_verbosity <= verbosity_threshold && record_verbosity != 0) {
+					group << record_verbosity << "\t" << records[pos].message << "\n";
+				}
 			}
+			string group_out = group.str();
+			if (!group_out.empty()) { WriteToLogFile(group_out); }
 		}
-		// log to Windows Application Log
+		// each Windows Event Log entry is written on its own, the file lock is 
+		// reentrant so the group still goes out uninterrupted
 		else if (log_mode == to_system || log_mode == 1) {
-			String^ s_message = gcnew String(message.c_str());
-			String^ s_source_name = gcnew String(source_name.c_str());
-			switch (message_verbosity) {
-			case 0: 
-				cout << "message_verbosity set to none, unable to log" << endl;
-				return;
-				break;
-			case 1: 
-				system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::Information);
-				break;
-			case 2: 
-				system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::Warning);
-				break;
-			case 3: 
-				system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::Error);
-				break;
-			case 4: 
-				system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::SuccessAudit);
-				break;
-			case 5:
-				system_log->WriteEntry(s_source_name, s_message, EventLogEntryType::FailureAudit);
-			default: 
-				cout << "Invalid verbosity_threshold " << endl;
-				break;
+			for (size_t pos = 0; pos < record_count; pos++) {
+				this->Log(records[pos].message, records[pos].record_verbosity);
 			}
 		}
 	}
+	finally {
+		Monitor::Exit(file_lock);
+	}
 }
 
 void Logger::WriteConfigFile(string user_config_file = "") {
@@ -566,6 +1190,9 @@ void Logger::WriteConfigFile(string user_config_file = "") {
 				config_file_out << config_options[2] << "\t" << verbosity_threshold << endl;
 				config_file_out << config_options[3] << "\t" << append_logs_ok << endl;
 				config_file_out << config_options[4] << "\t" << make_config_file_ok << endl;
+				config_file_out << config_options[5] << "\t" << trace_file_name << endl;
+				config_file_out << config_options[6] << "\t" << span_sample_rate << endl;
+				config_file_out << config_options[7] << "\t" << span_histograms_ok << endl;
 				config_file_out.close();
 				cout << "Config file " << user_config_file << " written successfully." << endl;
 		}
@@ -661,11 +1288,281 @@ void TestLogMethods() {
 
 }
 
+// Counts occurrences of text in a file written by a test
+int CountInFile(const string& file_name, const string& text) {
+	ifstream file_in(file_name);
+	string line;
+	int count = 0;
+	while (getline(file_in, line)) {
+		for (size_t pos = line.find(text); pos != string::npos; pos = line.find(text, pos + text.size())) {
+			count++;
+		}
+	}
+	return count;
+}
+
+// Reads every line of a file written by a test
+vector<string> ReadFileLines(const string& file_name) {
+	ifstream file_in(file_name);
+	vector<string> lines;
+	string line;
+	while (getline(file_in, line)) {
+		lines.push_back(line);
+	}
+	return lines;
+}
+
+// Opens spans from its own thread for TestSpanMethods
+ref class SpanThreadTester {
+  private:
+	Logger* logger;
+
+  public:
+	SpanThreadTester(Logger* thread_logger) : logger(thread_logger) {}
+
+	void Run() {
+		for (int pos = 0; pos < 100; pos++) {
+			LogSpan threaded = logger->Span("threaded");
+		}
+	}
+};
+
+void TestSpanMethods() {
+
+	Logger span_method_tester;
+	span_method_tester.Initialize();
+
+	const string trace_name = "span methods trace.json";
+	remove(trace_name.c_str());
+	remove("span methods.test");
+
+	span_method_tester.set_span_sample_rate(3);
+	span_method_tester.set_span_sample_rate(-1);	// ignored
+	if (span_method_tester.get_span_sample_rate() != 3) { cout << "span_sample_rate accessor fail" << endl; }
+	else { cout << "PASS span_sample_rate" << endl; }
+	span_method_tester.set_span_sample_rate(1);
+
+	span_method_tester.set_span_histograms_ok(true);
+	if (!span_method_tester.get_span_histograms_ok()) { cout << "span_histograms_ok accessor fail" << endl; }
+	else { cout << "PASS span_histograms_ok" << endl; }
+
+	span_method_tester.set_trace_file_name(trace_name);
+	if (span_method_tester.get_trace_file_name() != trace_name) { cout << "trace_file_name accessor fail" << endl; }
+	else { cout << "PASS trace_file_name" << endl; }
+
+	span_method_tester.set_log_file_name("span methods.test");
+	span_method_tester.set_verbosity_threshold(all);
+
+	// a flush with nothing buffered must leave the file valid for the next one
+	span_method_tester.WriteTraceFile();
+
+	{
+		LogSpan outer = span_method_tester.Span("outer");
+		for (int pos = 0; pos < 10; pos++) {
+			LogSpan inner = span_method_tester.Span("inner \"quoted\"");
+		}
+	}
+
+	// every other span kept in the trace, histograms still count all of them
+	span_method_tester.set_span_sample_rate(2);
+	for (int pos = 0; pos < 10; pos++) {
+		LogSpan sampled = span_method_tester.Span("sampled");
+	}
+
+	// no spans recorded when turned off
+	span_method_tester.set_span_sample_rate(0);
+	LogSpan skipped = span_method_tester.Span("skipped");
+	skipped.End();
+
+	// two more threads, each with its own buffer
+	span_method_tester.set_span_sample_rate(1);
+	Thread^ thread_a = gcnew Thread(gcnew ThreadStart(gcnew SpanThreadTester(&span_method_tester), &SpanThreadTester::Run));
+	Thread^ thread_b = gcnew Thread(gcnew ThreadStart(gcnew SpanThreadTester(&span_method_tester), &SpanThreadTester::Run));
+	thread_a->Start();
+	thread_b->Start();
+	thread_a->Join();
+	thread_b->Join();
+
+	span_method_tester.WriteTraceFile();
+
+	// the first event after [ must not be preceded by a separator
+	vector<string> trace_lines = ReadFileLines(trace_name);
+	size_t first_event = 1;
+	while (first_event < trace_lines.size() && trace_lines[first_event].empty()) { first_event++; }
+	if (trace_lines.empty() || trace_lines[0] != "[" || first_event == trace_lines.size() || trace_lines[first_event][0] != '{') {
+		cout << "trace file after empty write fail" << endl;
+	}
+	else { cout << "PASS trace file after empty write" << endl; }
+
+	if (CountInFile(trace_name, "\"name\":\"outer\"") != 1) { cout << "outer span count fail" << endl; }
+	else { cout << "PASS outer span count" << endl; }
+
+	if (CountInFile(trace_name, "\"name\":\"inner \\\"quoted\\\"\"") != 10) { cout << "inner span count or escaping fail" << endl; }
+	else { cout << "PASS inner span count and escaping" << endl; }
+
+	if (CountInFile(trace_name, "\"name\":\"sampled\"") != 5) { cout << "sampled span count fail" << endl; }
+	else { cout << "PASS sampled span count" << endl; }
+
+	if (CountInFile(trace_name, "\"name\":\"skipped\"") != 0) { cout << "skipped span count fail" << endl; }
+	else { cout << "PASS skipped span count" << endl; }
+
+	// threaded spans should come from exactly two thread ids, 100 each
+	map<int, int> threaded_spans;
+	ifstream trace_in(trace_name);
+	string trace_line;
+	while (getline(trace_in, trace_line)) {
+		size_t tid_pos = trace_line.find("\"tid\":");
+		if (trace_line.find("\"name\":\"threaded\"") != string::npos && tid_pos != string::npos) {
+			threaded_spans[atoi(trace_line.c_str() + tid_pos + 6)]++;
+		}
+	}
+	trace_in.close();
+	if (threaded_spans.size() != 2 || threaded_spans.begin()->second != 100 || threaded_spans.rbegin()->second != 100) {
+		cout << "per-thread span buffers fail" << endl;
+	}
+	else { cout << "PASS per-thread span buffers" << endl; }
+
+	// a second write appends to the same array instead of replacing the first
+	{
+		LogSpan appended = span_method_tester.Span("appended");
+	}
+	span_method_tester.WriteTraceFile();
+	if (CountInFile(trace_name, "\"name\":\"outer\"") != 1 || CountInFile(trace_name, "\"name\":\"appended\"") != 1 ||
+		CountInFile(trace_name, "[") != 1) {
+		cout << "trace file append fail" << endl;
+	}
+	else { cout << "PASS trace file append" << endl; }
+
+	span_method_tester.LogSpanHistograms();
+	// the worker threads have exited, their histograms must survive their buffers being retired
+	if (CountInFile("span methods.test", "span sampled <") != 1 || CountInFile("span methods.test", "span skipped") != 0 ||
+		CountInFile("span methods.test", "span threaded <") != 1) {
+		cout << "span histograms fail" << endl;
+	}
+	else { cout << "PASS span histograms" << endl; }
+}
+
+// Logs groups of numbered lines from its own thread for TestBulkLogMethods
+ref class BulkThreadTester {
+  private:
+	Logger* logger;
+	char tag;
+
+  public:
+	BulkThreadTester(Logger* thread_logger, char thread_tag) : logger(thread_logger), tag(thread_tag) {}
+
+	void Run() {
+		for (int group = 0; group < 20; group++) {
+			LogBatch batch;
+			for (int line = 0; line < 50; line++) {
+				ostringstream message;
+				message << "thread " << tag << " group " << group << " line " << line;
+				batch.Information(message.str());
+			}
+			logger->LogBulk(batch);
+		}
+	}
+};
+
+void TestBulkLogMethods() {
+
+	Logger bulk_method_tester;
+	bulk_method_tester.Initialize();
+
+	const string bulk_file_name = "bulk log methods.test";
+	remove(bulk_file_name.c_str());
+
+	bulk_method_tester.set_log_mode(to_log);
+	bulk_method_tester.set_log_file_name(bulk_file_name);
+	bulk_method_tester.set_verbosity_threshold(error);
+
+	// successaudit and failureaudit are above the threshold and should be skipped
+	LogBatch batch;
+	batch.Information("Bulk line 1");
+	batch.Warning("Bulk line 2");
+	batch.SuccessAudit("Should not be logged");
+	batch.Error("Bulk line 3");
+	batch.FailureAudit("Should not be logged either");
+	bulk_method_tester.LogBulk(batch);
+
+	vector<log_record> records;
+	records.push_back(log_record(warning, "Bulk line 4 from vector"));
+	records.push_back(log_record(error, "Bulk line 5 from vector"));
+	bulk_method_tester.LogBulk(records);
+
+	const string expected_lines[] = { "information\tBulk line 1", "warning\tBulk line 2", "error\tBulk line 3",
+		"warning\tBulk line 4 from vector", "error\tBulk line 5 from vector" };
+	vector<string> lines = ReadFileLines(bulk_file_name);
+	if (lines != vector<string>(expected_lines, expected_lines + 5)) { cout << "LogBulk lines fail" << endl; }
+	else { cout << "PASS LogBulk lines" << endl; }
+
+	// empty groups log nothing
+	batch.Clear();
+	bulk_method_tester.LogBulk(batch);
+	if (ReadFileLines(bulk_file_name).size() != lines.size()) { cout << "LogBulk empty batch fail" << endl; }
+	else { cout << "PASS LogBulk empty batch" << endl; }
+
+	// an overwriting Logger must not write over lines another Logger appended meanwhile
+	const string shared_file_name = "bulk log shared.test";
+	Logger overwrite_logger, append_logger;
+	overwrite_logger.Initialize();
+	append_logger.Initialize();
+	overwrite_logger.set_log_file_name(shared_file_name);
+	append_logger.set_log_file_name(shared_file_name);
+	overwrite_logger.set_append_logs_ok(false);
+	overwrite_logger.Information("Overwrite line 1");
+	append_logger.Information("Append line");
+	overwrite_logger.Information("Overwrite line 2");
+
+	const string shared_lines[] = { "information\tOverwrite line 1", "information\tAppend line", 
+		"information\tOverwrite line 2" };
+	if (ReadFileLines(shared_file_name) != vector<string>(shared_lines, shared_lines + 3)) { 
+		cout << "overwrite with shared file fail" << endl; 
+	}
+	else { cout << "PASS overwrite with shared file" << endl; }
+
+	// two Loggers on two threads sharing one file, each group of 50 lines must stay together
+	const string threads_file_name = "bulk log threads.test";
+	remove(threads_file_name.c_str());
+	Logger thread_logger_a, thread_logger_b;
+	thread_logger_a.Initialize();
+	thread_logger_b.Initialize();
+	thread_logger_a.set_log_file_name(threads_file_name);
+	thread_logger_b.set_log_file_name(threads_file_name);
+	thread_logger_a.set_verbosity_threshold(all);
+	thread_logger_b.set_verbosity_threshold(all);
+
+	Thread^ thread_a = gcnew Thread(gcnew ThreadStart(gcnew BulkThreadTester(&thread_logger_a, 'A'), &BulkThreadTester::Run));
+	Thread^ thread_b = gcnew Thread(gcnew ThreadStart(gcnew BulkThreadTester(&thread_logger_b, 'B'), &BulkThreadTester::Run));
+	thread_a->Start();
+	thread_b->Start();
+	thread_a->Join();
+	thread_b->Join();
+
+	vector<string> thread_lines = ReadFileLines(threads_file_name);
+	bool interleaved = thread_lines.size() != 2000;
+	string group_prefix;
+	int expected_line = 0;
+	for (size_t pos = 0; pos < thread_lines.size() && !interleaved; pos++) {
+		size_t line_pos = thread_lines[pos].find(" line ");
+		if (line_pos == string::npos) { interleaved = true; break; }
+		string prefix = thread_lines[pos].substr(0, line_pos);
+		int line = atoi(thread_lines[pos].c_str() + line_pos + 6);
+		if (expected_line == 0) { group_prefix = prefix; }
+		if (prefix != group_prefix || line != expected_line) { interleaved = true; }
+		expected_line = (line + 1) % 50;
+	}
+	if (interleaved) { cout << "LogBulk threads interleaved fail" << endl; }
+	else { cout << "PASS LogBulk threads" << endl; }
+}
+
 // Tests all the functionality of the Logger class
 void TestSuite() {
 	TestAccessors();
 	TestConfigMethods();
 	TestLogMethods();
+	TestSpanMethods();
+	TestBulkLogMethods();
 }
 
 int main(int argc, char *argv[])